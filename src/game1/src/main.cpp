@@ -26,6 +26,10 @@
 #include <ctime>
 #include <numeric>
 #include <cstdlib>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <utility>
 
 #include <SDL.h>
 #include <SDL2_gfxPrimitives.h> //install libsdl2-gfx-dev
@@ -33,12 +37,19 @@
 #include "SDL_syswm.h"
 #include <SDL_ttf.h>
 
+#include "cleanup.h"
+#include "quality_controller.h"
+#include "texture_cache.h"
+
 using namespace std;
 
 int SCREEN_WIDTH  = 1280;
 int SCREEN_HEIGHT = 720;
 
-string get_env_var(char * varname){
+size_t TEXTURE_BUDGET = 32 * 1024 * 1024; // bytes, RIPPLES_TEXTURE_BUDGET overrides
+double FRAME_BUDGET = 33.3; // ms, RIPPLES_FRAME_BUDGET overrides
+
+string get_env_var(const char * varname){
     const char* ret = getenv(varname);
     string var;
     if (ret != NULL) {
@@ -49,14 +60,22 @@ string get_env_var(char * varname){
     return string("oops"); 
 }
 
-const char * get_env_var_const(char * varname){
-    const char* ret = getenv(varname);
-    if (ret != NULL) {
-        return ret;
-    } else {
-        return "not set";
+/*
+ * value of varname if it is set to a positive number, else fallback. A value
+ * that does not fully parse or is not positive is reported and ignored
+ */
+double get_env_positive(const char * varname, double fallback){
+    string var = get_env_var(varname);
+    if (var == "not set") {
+        return fallback;
+    }
+    char *end;
+    double value = strtod(var.c_str(), &end);
+    if (end == var.c_str() || *end != '\0' || !(value > 0) || std::isinf(value)) {
+        printf("warning: ignoring %s=%s, expected a positive number\n", varname, var.c_str());
+        return fallback;
     }
-    return "oops"; 
+    return value;
 }
 
 
@@ -169,6 +188,23 @@ void addCircle(shared_ptr<vector<shared_ptr<Circle>>> cs, int x = 20, int y = 80
     cs->emplace_back(c);
 }
 
+/*
+ * background grid covering the screen with one circle every grid pixels
+ */
+shared_ptr<vector<shared_ptr<Circle>>> buildGrid(int grid) {
+    shared_ptr<vector<shared_ptr<Circle>>> grid_circles = make_shared<vector<shared_ptr<Circle>>>();
+    int x_iters = int(SCREEN_WIDTH/grid);
+    int y_iters = int(SCREEN_HEIGHT/grid);
+    for ( int x=0; x <= x_iters; ++x)
+    {
+        for (int y=0; y <= y_iters; ++y)
+        {
+            addCircle(grid_circles, x * grid, y * grid, 200,200,200, 50);
+        }
+    }
+    return grid_circles;
+}
+
 //shared_ptr<MovingCircle> addMovingCircle(shared_ptr<vector<shared_ptr<MovingCircle>>> cs, int x, int y) {
 shared_ptr<MovingCircle> addMovingCircle(shared_ptr<vector<shared_ptr<MovingCircle>>> cs, int x, int y) {
     shared_ptr<MovingCircle> c = make_shared<MovingCircle>();
@@ -331,29 +367,108 @@ void moveCircle(shared_ptr<MovingCircle> c, bool wrap) {
     return;
 }
 
-void cleanup(SDL_Window * window, SDL_Renderer * renderer) {
-    SDL_DestroyWindow(window);
-    SDL_DestroyRenderer(renderer);
+/*
+ * swept circle collision: both circles are taken to travel in a straight line
+ * from prevP to p during the last tick, so fast or coarsely ticked circles can
+ * not pass through each other between two positions.
+ * toi is set to the time of impact as a fraction of the tick (0 at prevP, 1 at p)
+ */
+bool isSweptCollided(shared_ptr<MovingCircle> c1, shared_ptr<MovingCircle> c2, double &toi) {
+    // c1 relative to c2: start offset and motion over the tick
+    double sx = c1->prevP.x - c2->prevP.x;
+    double sy = c1->prevP.y - c2->prevP.y;
+    double vx = (c1->p.x - c1->prevP.x) - (c2->p.x - c2->prevP.x);
+    double vy = (c1->p.y - c1->prevP.y) - (c2->p.y - c2->prevP.y);
+    double radii = c1->r + c2->r;
+
+    // solve |s + t * v| = radii for t
+    double a = vx * vx + vy * vy;
+    double b = 2 * (sx * vx + sy * vy);
+    double c = sx * sx + sy * sy - radii * radii;
+    if (c < 0) {
+        // already touching at the start of the tick
+        toi = 0;
+        return true;
+    }
+    if (a == 0) {
+        return false; // no relative movement
+    }
+    double discriminant = b * b - 4 * a * c;
+    if (discriminant < 0) {
+        return false; // paths never get close enough
+    }
+    double t = (-b - sqrt(discriminant)) / (2 * a);
+    if (t < 0 || t > 1) {
+        return false; // closest approach is outside this tick
+    }
+    toi = t;
+    return true;
 }
 
-void cleanup(SDL_Window * window) {
-    SDL_DestroyWindow(window);
+/*
+ * quality knobs, lowest first. The adaptive controller moves between these
+ * levels depending on how long frames take
+ */
+struct Quality {
+    bool filled;          // filled or outline bullets and hit targets
+    int collision_frames; // frames a hit target stays on screen
+    float render_scale;   // scene is drawn at this fraction of the screen size
+};
+
+Quality const QUALITY_LEVELS[] = {
+    {false, 5, 0.5f},
+    {false, 10, 0.75f},
+    {true, 15, 1.0f},
+    {true, 20, 1.0f},
+};
+int const QUALITY_COUNT = sizeof(QUALITY_LEVELS) / sizeof(QUALITY_LEVELS[0]);
+
+void printQuality(int level, Quality const& q) {
+    printf("quality: level %d of %d: %s circles, hit frames %d, render scale %.2f\n",
+           level, QUALITY_COUNT - 1, q.filled ? "filled" : "outline",
+           q.collision_frames, q.render_scale);
 }
 
-void cleanup(SDL_Renderer * renderer) {
-    SDL_DestroyRenderer(renderer);
+/*
+ * below full scale the scene is drawn to a smaller offscreen texture that is
+ * stretched over the screen. It is used every frame, so it is pinned in the
+ * cache. Renderers without target textures stay at full scale
+ */
+void setRenderScale(SDL_Renderer *renderer, TextureCache &textures, float scale) {
+    if (scale >= 1.0f || !SDL_RenderTargetSupported(renderer)) {
+        textures.remove("scene");
+        return;
+    }
+    int w = SCREEN_WIDTH * scale;
+    int h = SCREEN_HEIGHT * scale;
+    textures.add("scene", [w, h](SDL_Renderer *renderer) {
+        return SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, w, h);
+    }, true);
 }
 
-bool isCollided(shared_ptr<Circle> c1, shared_ptr<Circle> c2) {
-    int dx = c1->p.x - c2->p.x;
-    int dy = c1->p.y - c2->p.y;
-    int distance = sqrt(dx * dx + dy * dy);
+/*
+ * point drawing at the scene texture if there is one. Returns it or NULL when
+ * drawing goes straight to the screen
+ */
+SDL_Texture *beginScene(SDL_Renderer *renderer, TextureCache &textures, float scale) {
+    if (scale >= 1.0f || !SDL_RenderTargetSupported(renderer)) {
+        return NULL;
+    }
+    SDL_Texture *scene = textures.get("scene");
+    if (scene == NULL || SDL_SetRenderTarget(renderer, scene) != 0) {
+        return NULL;
+    }
+    SDL_RenderSetScale(renderer, scale, scale);
+    return scene;
+}
 
-    if (distance < c1->r + c2->r) {
-        // collision detected!
-        return true;
+void endScene(SDL_Renderer *renderer, SDL_Texture *scene) {
+    if (scene == NULL) {
+        return;
     }
-    return false;
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_RenderSetScale(renderer, 1.0f, 1.0f);
+    SDL_RenderCopy(renderer, scene, NULL, NULL);
 }
 
 void help(){
@@ -365,28 +480,94 @@ void help(){
   printf("See also README* in install directory.\n");
 }
 
-void message(SDL_Renderer *renderer, int x, int y, char *text,
-             TTF_Font *font, SDL_Texture **texture, SDL_Rect *rect) {
-    int text_width;
-    int text_height;
-    SDL_Surface *surface;
+/*
+ * rasterize text. Only touches the font, so it can run before the renderer exists
+ */
+SDL_Surface *messageSurface(char const *text, TTF_Font *font) {
     SDL_Color textColor = {255, 255, 255, 0};
+    return TTF_RenderText_Solid(font, text, textColor);
+}
 
-    surface = TTF_RenderText_Solid(font, text, textColor);
-    *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    text_width = surface->w;
-    text_height = surface->h;
-    SDL_FreeSurface(surface);
-    //SDL_DestroyTexture(&&texture);
+/*
+ * register rasterized text as texture key and place it at x, y. The surface is
+ * kept so the texture can be re-created after the cache evicts it
+ */
+void messageTexture(TextureCache &textures, string const& key, int x, int y,
+                    shared_ptr<SDL_Surface> surface, SDL_Rect *rect) {
+    textures.add(key, [surface](SDL_Renderer *renderer) {
+        return SDL_CreateTextureFromSurface(renderer, surface.get());
+    });
     rect->x = x;
     rect->y = y;
-    rect->w = text_width;
-    rect->h = text_height;
+    rect->w = surface->w;
+    rect->h = surface->h;
+}
+
+/*
+ * records how long each startup step takes, from any thread, and prints them
+ * together with the time from process start to the first present
+ */
+class StartupTrace {
+public:
+    typedef chrono::steady_clock Clock;
+
+    StartupTrace() : origin(Clock::now()) {}
+
+    Clock::time_point now() const {
+        return Clock::now();
+    }
+
+    void step(string const& name, Clock::time_point start) {
+        double ms = getMs(start, Clock::now());
+        lock_guard<mutex> lock(steps_mutex);
+        steps.emplace_back(name, ms);
+    }
+
+    void report() {
+        double total = getMs(origin, Clock::now());
+        lock_guard<mutex> lock(steps_mutex);
+        for (auto const& s : steps) {
+            printf("startup: %-28s %8.2f ms\n", s.first.c_str(), s.second);
+        }
+        printf("startup: time to first present %8.2f ms\n", total);
+    }
+
+private:
+    static double getMs(Clock::time_point from, Clock::time_point to) {
+        return chrono::duration<double, milli>(to - from).count();
+    }
+
+    Clock::time_point origin;
+    mutex steps_mutex;
+    vector<pair<string, double>> steps;
+};
+
+// font and rasterized onscreen text, prepared off the main thread
+struct TextAssets {
+    Owned<TTF_Font> font;
+    shared_ptr<SDL_Surface> help;
+    shared_ptr<SDL_Surface> done;
+};
+
+TextAssets loadText(string const& font_path, StartupTrace &trace) {
+    TextAssets assets;
+    StartupTrace::Clock::time_point t = trace.now();
+    TTF_Init();
+    assets.font.reset(TTF_OpenFont(font_path.c_str(), 24));
+    trace.step("font load (bg)", t);
+    if (!assets.font) {
+        return assets;
+    }
+    t = trace.now();
+    assets.help.reset(messageSurface("Aim: left/right arrows. Shoot: space bar. Quit: ESC", assets.font.get()),
+                      Cleanup<SDL_Surface>());
+    assets.done.reset(messageSurface("Got them all!", assets.font.get()), Cleanup<SDL_Surface>());
+    trace.step("text raster (bg)", t);
+    return assets;
 }
 
 //for onscreen text
 SDL_Rect rect1, rect2;
-SDL_Texture *texture1, *texture2;
 
 bool short_game = false; //use short flag to have short game
 
@@ -394,6 +575,9 @@ bool is_snap = false;
 
 int main(int argc, char *argv[]) {
 
+    StartupTrace trace;
+    StartupTrace::Clock::time_point t;
+
     // check if is snap
     string snap = get_env_var("SNAP");
     if ( snap != "not_set"){
@@ -421,9 +605,23 @@ int main(int argc, char *argv[]) {
 
     srand(time(0));
 
+    //onscreen text: font loading and rasterizing only need the font file, so
+    //do it in the background while the window and renderer are created
+    string font_path;
+    if (is_snap) {
+        font_path = snap + "/fonts/Ubuntu-C.ttf";
+    } else {
+        printf("NOT a snap\n");
+        font_path = "/usr/share/fonts/truetype/ubuntu/Ubuntu-C.ttf";
+    }
+    future<TextAssets> text_job = async(launch::async, loadText, font_path, ref(trace));
+
+    t = trace.now();
     SDL_Init(SDL_INIT_VIDEO);
+    trace.step("SDL_Init", t);
     SDL_Window *window;
     SDL_Renderer *renderer;
+    t = trace.now();
     window  = SDL_CreateWindow( "Ripples", 
                                 SDL_WINDOWPOS_CENTERED,
                                 SDL_WINDOWPOS_CENTERED,
@@ -436,8 +634,20 @@ int main(int argc, char *argv[]) {
     } else {
         printf("Window created.\n");
     }
+    trace.step("SDL_CreateWindow", t);
+    t = trace.now();
     setScreen();
+    trace.step("setScreen", t);
+
+    // grid only depends on the screen size
+    future<shared_ptr<vector<shared_ptr<Circle>>>> grid_job = async(launch::async, [&trace]() -> shared_ptr<vector<shared_ptr<Circle>>> {
+        StartupTrace::Clock::time_point t = trace.now();
+        shared_ptr<vector<shared_ptr<Circle>>> grid_circles = buildGrid(20);
+        trace.step("grid (bg)", t);
+        return grid_circles;
+    });
      
+    t = trace.now();
     SDL_SysWMinfo info;
 
     if (SDL_GetWindowWMInfo(window,&info)) {
@@ -447,33 +657,36 @@ int main(int argc, char *argv[]) {
     } else {
       printf("Probably not a wayland system. Possible error (expected on classic though). %s\n", SDL_GetError());
     }
+    trace.step("WM info", t);
     
+    t = trace.now();
     renderer = SDL_CreateRenderer(window,-1,SDL_RENDERER_ACCELERATED);
+    trace.step("SDL_CreateRenderer", t);
 
     if ( window == nullptr || renderer == nullptr ) {
         cout << "SDL setup error. Quitting" << endl;
         return 1;
     }
 
-    //onscreen text
-    TTF_Init();
-    TTF_Font *font;
-    if (is_snap) {
-        const char* snap = get_env_var_const("SNAP");
-        const char* path = "/fonts/Ubuntu-C.ttf";
-        char result[500];
-        strcpy(result,snap);
-        strcat(result,path);
-        font = TTF_OpenFont(result, 24);
-    } else {
-        printf("NOT a snap\n");
-        font = TTF_OpenFont("/usr/share/fonts/truetype/ubuntu/Ubuntu-C.ttf", 24);
-    }
-    if (font == NULL) {
+    t = trace.now();
+    TextAssets text = text_job.get();
+    trace.step("wait for text", t);
+    if (!text.font) {
         fprintf(stderr, "error: font not found\n");
         return 1;
     }
 
+    TEXTURE_BUDGET = get_env_positive("RIPPLES_TEXTURE_BUDGET", TEXTURE_BUDGET);
+    TextureCache textures(renderer, TEXTURE_BUDGET);
+
+    // start at full quality and let the controller step down if frames run long
+    FRAME_BUDGET = get_env_positive("RIPPLES_FRAME_BUDGET", FRAME_BUDGET);
+    QualityController quality_control(FRAME_BUDGET, QUALITY_COUNT, QUALITY_COUNT - 1);
+    Quality quality = QUALITY_LEVELS[quality_control.getLevel()];
+    printf("quality: frame budget %.2f ms\n", quality_control.getBudget());
+    printQuality(quality_control.getLevel(), quality);
+    setRenderScale(renderer, textures, quality.render_scale);
+
     shared_ptr<Gun> gun = make_shared<Gun>();
     gun->angle = 0;
     gun-> length = 50;
@@ -484,38 +697,36 @@ int main(int argc, char *argv[]) {
     shared_ptr<vector<shared_ptr<MovingCircle>>> bullets = make_shared<vector<shared_ptr<MovingCircle>>>();
 
     // vector of grid circles
-    shared_ptr<vector<shared_ptr<Circle>>> grid_circles = make_shared<vector<shared_ptr<Circle>>>();
+    t = trace.now();
+    shared_ptr<vector<shared_ptr<Circle>>> grid_circles = grid_job.get();
+    trace.step("wait for grid", t);
 
     // vector of "target" circles
     shared_ptr<vector<shared_ptr<MovingCircle>>> ripples = make_shared<vector<shared_ptr<MovingCircle>>>();
 
-    int x_iters = int(SCREEN_WIDTH/20);
-    int y_iters = int(SCREEN_HEIGHT/20);
-    int  grid = 20;
-    for ( int x=0; x <= x_iters; ++x)
-    {
-        for (int y=0; y <= y_iters; ++y)
-        {
-            addCircle(grid_circles, x * grid, y * grid, 200,200,200, 50);
-        }
-    }
-
     SDL_Event e;
     int mx = gun->x - 40;
     int my = gun->y + 40;
     rotateGun(gun,1);
 
-    message(renderer, 10, 10, "Aim: left/right arrows. Shoot: space bar. Quit: ESC", font, &texture1, &rect1);
-    message(renderer, 50, 50, "Got them all!", font, &texture2, &rect2);
+    // upload the help text now so the first frame doesn't have to
+    t = trace.now();
+    messageTexture(textures, "help", 10, 10, text.help, &rect1);
+    messageTexture(textures, "done", 50, 50, text.done, &rect2);
+    textures.get("help");
+    trace.step("text textures", t);
 
     int idx = -1;
     // used to handle KEYUP/DOWN for aiming the gun
     bool aim = false;
     bool start = true;
+    bool first_present = true;
     while (!quit) {
         idx += 1;
         clock_t startTime = clock();
+        chrono::steady_clock::time_point frameStart = chrono::steady_clock::now();
 
+        SDL_Texture *scene = beginScene(renderer, textures, quality.render_scale);
         SDL_SetRenderDrawColor( renderer, 20,20,20, 255 );
         SDL_RenderClear(renderer);
 
@@ -619,19 +830,17 @@ int main(int argc, char *argv[]) {
         }
 
         //move bullets
-        shared_ptr<vector<shared_ptr<MovingCircle>>> new_bullets = make_shared<vector<shared_ptr<MovingCircle>>>();
         for( shared_ptr<MovingCircle> &c : *bullets ) {
             moveCircle(c,false);
-            if (c->p.x < SCREEN_WIDTH && c->p.x > 0 && c->p.y < SCREEN_HEIGHT && c->p.y > 0 ) {
-                new_bullets->emplace_back(c); // keep if still on screen
-            }
         }
-        bullets = new_bullets;
 
+        // test the whole tick's movement so hits are found even when a bullet
+        // steps over a target or leaves the screen in the same tick
         bool collision = false;
+        double toi;
         for( shared_ptr<MovingCircle> &b : *bullets ) {
             for( shared_ptr<MovingCircle> &r : *ripples ) {
-                collision = isCollided(b, r);
+                collision = isSweptCollided(b, r, toi);
                 if (collision) {
                     //cout << "Collision!" << endl;
                     b->collided = true;
@@ -641,10 +850,14 @@ int main(int argc, char *argv[]) {
                 }
             }
         }
-        // show help at top of screen
-        SDL_SetRenderDrawColor(renderer, 20, 20, 20, 0); //sets background
-        //SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture1, NULL, &rect1);//sets text
+
+        shared_ptr<vector<shared_ptr<MovingCircle>>> new_bullets = make_shared<vector<shared_ptr<MovingCircle>>>();
+        for( shared_ptr<MovingCircle> &c : *bullets ) {
+            if (c->p.x < SCREEN_WIDTH && c->p.x > 0 && c->p.y < SCREEN_HEIGHT && c->p.y > 0 ) {
+                new_bullets->emplace_back(c); // keep if still on screen
+            }
+        }
+        bullets = new_bullets;
 
         //render ripple circles
         for( shared_ptr<MovingCircle> &c : *ripples )
@@ -653,10 +866,14 @@ int main(int argc, char *argv[]) {
                 circleRGBA(renderer, c->p.x, c->p.y, c->r, c->rgb.r, c->rgb.g, c->rgb.b, c->rgb.a);
             } else { //draw as collided and update
                 //circleRGBA(renderer, c->p.x, c->p.y, c->r, 200, 100, 100, c->rgb.a);
-                filledCircleRGBA(renderer, c->p.x, c->p.y, c->r, 230, 10, 10, 255);
+                if (quality.filled) {
+                    filledCircleRGBA(renderer, c->p.x, c->p.y, c->r, 230, 10, 10, 255);
+                } else {
+                    circleRGBA(renderer, c->p.x, c->p.y, c->r, 230, 10, 10, 255);
+                }
                 c->collision_render_count += 1;
             }
-            if (c->collision_render_count < 20) {
+            if (c->collision_render_count < quality.collision_frames) {
                 remaining_ripples->emplace_back(c);
             }
         }
@@ -669,7 +886,12 @@ int main(int argc, char *argv[]) {
         //Render bullets
         for( shared_ptr<MovingCircle> &c : *bullets ) {
             SDL_SetRenderDrawColor( renderer, c->rgb.b, c->rgb.g, c->rgb.r, c->rgb.a);
-            int res = filledCircleRGBA(renderer, c->p.x, c->p.y, c->r, c->rgb.r, c->rgb.g, c->rgb.b, c->rgb.a);
+            int res;
+            if (quality.filled) {
+                res = filledCircleRGBA(renderer, c->p.x, c->p.y, c->r, c->rgb.r, c->rgb.g, c->rgb.b, c->rgb.a);
+            } else {
+                res = circleRGBA(renderer, c->p.x, c->p.y, c->r, c->rgb.r, c->rgb.g, c->rgb.b, c->rgb.a);
+            }
             if (res == -1)
                 cout << "=========== ERROR res: " << res << endl;
         }
@@ -678,10 +900,17 @@ int main(int argc, char *argv[]) {
         SDL_SetRenderDrawColor( renderer, 200, 100, 200, 255 );
         SDL_RenderDrawLine(renderer, gun->x, gun->y, gun->x2, gun->y2);
 
+        endScene(renderer, scene);
+
+        // show help at top of screen, drawn after the scene so text stays at full resolution
+        SDL_SetRenderDrawColor(renderer, 20, 20, 20, 0); //sets background
+        //SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, textures.get("help"), NULL, &rect1);//sets text
+
         bool end = false;
         if (!start && ripples->size() == 0){
             SDL_RenderClear(renderer);
-            SDL_RenderCopy(renderer, texture2, NULL, &rect2);//sets text
+            SDL_RenderCopy(renderer, textures.get("done"), NULL, &rect2);//sets text
             start = true;
             idx = -1;
             end = true;
@@ -689,6 +918,21 @@ int main(int argc, char *argv[]) {
 
         //Update the screen
         SDL_RenderPresent(renderer);
+        if (first_present) {
+            trace.report();
+            first_present = false;
+        }
+
+        // adapt quality to how long this frame took, before any deliberate delay
+        double frameMs = chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count();
+        if (quality_control.addFrame(frameMs)) {
+            Quality next = QUALITY_LEVELS[quality_control.getLevel()];
+            if (next.render_scale != quality.render_scale) {
+                setRenderScale(renderer, textures, next.render_scale);
+            }
+            quality = next;
+            printQuality(quality_control.getLevel(), quality);
+        }
         if (end) {
             SDL_Delay(5000);
         }
@@ -701,7 +945,11 @@ int main(int argc, char *argv[]) {
             SDL_Delay(0.0333 - ellapsed);
     }
 
-    cleanup(window, renderer);
+    textures.report();
+    textures.clear();
+    text.font.reset();
+    cleanup(renderer, window);
+    TTF_Quit();
     SDL_Quit();
 
     return 0;
@@ -1,8 +1,10 @@
 #ifndef CLEANUP_H
 #define CLEANUP_H
 
+#include <memory>
 #include <utility>
 #include <SDL.h>
+#include <SDL_ttf.h>
 
 /*
  * Recurse through the list of arguments to clean up, cleaning up
@@ -49,6 +51,27 @@ void cleanup<SDL_Surface>(SDL_Surface *surf){
 	}
 	SDL_FreeSurface(surf);
 }
+template<>
+void cleanup<TTF_Font>(TTF_Font *font){
+	if (!font){
+		return;
+	}
+	TTF_CloseFont(font);
+}
+
+/*
+ * Deleter calling the matching specialization above, so the same cleanup
+ * code can own a resource through a smart pointer, eg.
+ * Owned<SDL_Texture> tex(SDL_CreateTextureFromSurface(ren, surf));
+ */
+template<typename T>
+struct Cleanup {
+	void operator()(T *t) const {
+		cleanup(t);
+	}
+};
+template<typename T>
+using Owned = std::unique_ptr<T, Cleanup<T>>;
 
 #endif
 
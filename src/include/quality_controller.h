@@ -0,0 +1,90 @@
+#ifndef QUALITY_CONTROLLER_H
+#define QUALITY_CONTROLLER_H
+
+#include <cstdio>
+#include <vector>
+
+/*
+ * Picks a quality level (0 is lowest, levels - 1 is highest) from recent frame
+ * times. After a full window of frames the average is compared to the budget:
+ * over budget steps down, well under it steps up. The gap between the two
+ * thresholds and a wait before stepping back up after a step down keep it from
+ * bouncing between two levels; the wait doubles each time a step up had to be
+ * undone straight away.
+ */
+class QualityController {
+public:
+    QualityController(double budget_ms, int levels, int level, size_t window = 30)
+        : budget_ms(budget_ms), levels(levels), level(level), window(window) {
+        samples.reserve(window);
+    }
+
+    /*
+     * feed the time one frame took. Returns true when the level changed
+     */
+    bool addFrame(double ms) {
+        samples.push_back(ms);
+        if (samples.size() < window) {
+            return false;
+        }
+        double total = 0;
+        for (double s : samples) {
+            total += s;
+        }
+        double average = total / samples.size();
+        samples.clear();
+
+        if (hold > 0) {
+            hold -= 1;
+        }
+        if (average > budget_ms * over && level > 0) {
+            setLevel(level - 1, average);
+            if (stepped_up && up_hold < max_up_hold) {
+                up_hold *= 2;
+            } else if (!stepped_up) {
+                up_hold = min_up_hold;
+            }
+            hold = up_hold; // don't try this level again right away
+            stepped_up = false;
+            return true;
+        }
+        if (average < budget_ms * headroom && level < levels - 1 && hold == 0) {
+            setLevel(level + 1, average);
+            stepped_up = true;
+            return true;
+        }
+        stepped_up = false;
+        return false;
+    }
+
+    int getLevel() const {
+        return level;
+    }
+
+    double getBudget() const {
+        return budget_ms;
+    }
+
+private:
+    void setLevel(int new_level, double average) {
+        printf("quality: level %d -> %d (average frame %.2f ms, budget %.2f ms)\n",
+               level, new_level, average, budget_ms);
+        level = new_level;
+    }
+
+    double const over = 1.0;     // step down above this fraction of the budget
+    double const headroom = 0.6; // step up below this fraction of the budget
+    int const min_up_hold = 4;   // windows to wait before stepping back up
+    int const max_up_hold = 64;
+
+    double budget_ms;
+    int levels;
+    int level;
+    size_t window;
+    int hold = 0;
+    int up_hold = min_up_hold;
+    bool stepped_up = false;
+    std::vector<double> samples;
+};
+
+#endif
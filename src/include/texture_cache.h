@@ -0,0 +1,188 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <SDL.h>
+
+#include "cleanup.h"
+
+/*
+ * Owns all textures by key and keeps their total size within a byte budget.
+ * Each texture is registered with a factory that can create it again, so when
+ * the budget would be exceeded the least recently used textures are destroyed
+ * and get re-created the next time they are asked for. Pinned textures, such
+ * as render targets used every frame, count towards the budget but are never
+ * evicted.
+ *
+ * A pointer returned by get() is only valid until the next call to get(),
+ * since that may evict it. Fetch textures right before drawing them.
+ */
+class TextureCache {
+public:
+    typedef std::function<SDL_Texture *(SDL_Renderer *)> Factory;
+
+    struct Stats {
+        size_t live_textures = 0;
+        size_t bytes = 0;
+        size_t creations = 0;
+        size_t evictions = 0;
+        size_t overruns = 0; // times a single texture did not fit the budget
+    };
+
+    TextureCache(SDL_Renderer *renderer, size_t budget)
+        : renderer(renderer), budget(budget) {}
+
+    ~TextureCache() {
+        clear();
+    }
+
+    TextureCache(TextureCache const&) = delete;
+    TextureCache &operator=(TextureCache const&) = delete;
+
+    /*
+     * register (or replace) the factory for key. Nothing is created until get()
+     */
+    void add(std::string const& key, Factory factory, bool pinned = false) {
+        remove(key);
+        entries[key].factory = factory;
+        entries[key].pinned = pinned;
+    }
+
+    void remove(std::string const& key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return;
+        }
+        release(it->second);
+        entries.erase(it);
+    }
+
+    /*
+     * the texture for key, created if needed. NULL for unknown keys or when
+     * the factory fails
+     */
+    SDL_Texture *get(std::string const& key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            printf("texture cache: unknown texture %s\n", key.c_str());
+            return NULL;
+        }
+        Entry &entry = it->second;
+        if (entry.texture) {
+            if (!entry.pinned) {
+                lru.splice(lru.begin(), lru, entry.lru);
+            }
+            return entry.texture.get();
+        }
+
+        Owned<SDL_Texture> texture(entry.factory(renderer));
+        if (!texture) {
+            printf("texture cache: could not create %s: %s\n", key.c_str(), SDL_GetError());
+            return NULL;
+        }
+        size_t bytes = getTextureBytes(texture.get());
+        makeRoom(bytes);
+        if (stats.bytes + bytes > budget) {
+            stats.overruns += 1;
+            printf("texture cache: over budget! %s needs %zu bytes, %zu of %zu in use\n",
+                   key.c_str(), bytes, stats.bytes, budget);
+        }
+
+        entry.texture = std::move(texture);
+        entry.bytes = bytes;
+        if (!entry.pinned) {
+            lru.push_front(key);
+            entry.lru = lru.begin();
+        }
+        stats.live_textures += 1;
+        stats.bytes += bytes;
+        stats.creations += 1;
+        return entry.texture.get();
+    }
+
+    /*
+     * destroy every texture and forget all factories
+     */
+    void clear() {
+        for (auto &e : entries) {
+            release(e.second);
+        }
+        entries.clear();
+        if (stats.live_textures != 0 || stats.bytes != 0) {
+            printf("texture cache: leak! %zu textures, %zu bytes still counted after clear\n",
+                   stats.live_textures, stats.bytes);
+        }
+    }
+
+    void setBudget(size_t bytes) {
+        budget = bytes;
+        makeRoom(0);
+    }
+
+    Stats const& getStats() const {
+        return stats;
+    }
+
+    void report() const {
+        printf("texture cache: %zu live, %zu of %zu bytes, %zu created, %zu evicted, %zu overruns\n",
+               stats.live_textures, stats.bytes, budget, stats.creations, stats.evictions, stats.overruns);
+    }
+
+private:
+    struct Entry {
+        Factory factory;
+        Owned<SDL_Texture> texture;
+        size_t bytes = 0;
+        bool pinned = false;
+        std::list<std::string>::iterator lru;
+    };
+
+    static size_t getTextureBytes(SDL_Texture *texture) {
+        Uint32 format;
+        int w, h;
+        if (SDL_QueryTexture(texture, &format, NULL, &w, &h) != 0) {
+            return 0;
+        }
+        size_t bpp = SDL_BYTESPERPIXEL(format);
+        if (bpp == 0) {
+            bpp = 4; // planar formats report 0, count them as the common case
+        }
+        return size_t(w) * h * bpp;
+    }
+
+    /*
+     * evict least recently used textures until bytes more will fit
+     */
+    void makeRoom(size_t bytes) {
+        while (!lru.empty() && stats.bytes + bytes > budget) {
+            Entry &victim = entries[lru.back()];
+            release(victim);
+            stats.evictions += 1;
+        }
+    }
+
+    void release(Entry &entry) {
+        if (!entry.texture) {
+            return;
+        }
+        entry.texture.reset();
+        if (!entry.pinned) {
+            lru.erase(entry.lru);
+        }
+        stats.live_textures -= 1;
+        stats.bytes -= entry.bytes;
+        entry.bytes = 0;
+    }
+
+    SDL_Renderer *renderer;
+    size_t budget;
+    std::map<std::string, Entry> entries;
+    std::list<std::string> lru; // resident unpinned keys, most recently used first
+    Stats stats;
+};
+
+#endif